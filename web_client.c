@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <assert.h>
@@ -7,6 +8,11 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <ctype.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #define DEFAULT_HTTP_PORT 80
 #define CHUNK_SIZE 1024
@@ -21,56 +27,833 @@ struct hostent *host;
 
 const char *delimiter = "\r\n\r\n";
 
-url_t parse_url(const char *szURL) {
-    url_t url;
-    memset(&url, 0, sizeof (url));
+/* Fills 'url' from szURL. Returns 0 on success, -1 if the URL could not be
+ * parsed (an error is printed and nothing needs to be freed). */
+int try_parse_url(const char *szURL, url_t *url) {
+    memset(url, 0, sizeof (*url));
 
     unsigned int urllen = strlen(szURL) + 1;
-    url.szServer = (char*) malloc(urllen * sizeof (char));
-    assert(NULL != url.szServer);
-    url.szFile = (char*) malloc(urllen * sizeof (char));
-    assert(NULL != url.szFile);
+    url->szServer = (char*) malloc(urllen * sizeof (char));
+    assert(NULL != url->szServer);
+    url->szFile = (char*) malloc(urllen * sizeof (char));
+    assert(NULL != url->szFile);
 
     char server[urllen];
 
     /* Ignores the 'http://' which begins the string. Put everything not a 
      * '/' into 'server', the rest goes into the file string. */
-    int result = sscanf(szURL, "http://%[^/]/%s", server, url.szFile);
+    int result = sscanf(szURL, "http://%[^/]/%s", server, url->szFile);
     if (EOF == result) {
         fprintf(stderr, "Failed to parse URL: %s\n", strerror(errno));
-        exit(1);
+        goto fail;
     } else if (1 == result) {
-        url.szFile[0] = '\0';
+        url->szFile[0] = '\0';
     } else if (result < 1) {
         fprintf(stderr, "Error: %s is not a valid HTTP request\n", szURL);
-        exit(1);
+        goto fail;
     }
 
     /* Puts everything up to a ':' character into the server string.
      * The number after is the port. */
-    result = sscanf(server, "%[^:]:%hu", url.szServer, &url.usPort);
+    result = sscanf(server, "%[^:]:%hu", url->szServer, &url->usPort);
     if (EOF == result) {
         fprintf(stderr, "Failed to parse URL: %s\n", strerror(errno));
-        exit(1);
+        goto fail;
     } else if (1 == result) {
-        url.usPort = DEFAULT_HTTP_PORT;
+        url->usPort = DEFAULT_HTTP_PORT;
     } else if (result < 1) {
         fprintf(stderr, "Error: %s is not a valid HTTP request\n", szURL);
-        exit(1);
+        goto fail;
     }
 
-    assert(NULL != url.szServer);
-    assert(NULL != url.szFile);
-    assert(url.usPort > 0);
+    assert(NULL != url->szServer);
+    assert(NULL != url->szFile);
+    assert(url->usPort > 0);
+    return 0;
+
+fail:
+    free(url->szServer);
+    free(url->szFile);
+    memset(url, 0, sizeof (*url));
+    return -1;
+}
+
+url_t parse_url(const char *szURL) {
+    url_t url;
+    if (try_parse_url(szURL, &url) < 0) {
+        exit(1);
+    }
     return url;
 }
 
+/**Batch / mirror mode**/
+//
+/* Instead of one URL per process, batch mode takes a list of URLs (from the
+ * command line, a file or stdin), groups them by host:port and fetches each
+ * group over as few keep-alive connections as possible, keeping up to
+ * g_iPipelineDepth requests in flight per connection. Up to g_iMaxHosts groups
+ * are fetched at once, each by its own child process. Every response body is
+ * written into a mirror tree under g_szMirrorDir/<server>_<port>/. */
+
+#define DEFAULT_PIPELINE_DEPTH 4
+#define DEFAULT_MAX_HOSTS 4
+#define DEFAULT_MIRROR_DIR "./mirror"
+#define DEFAULT_INDEX_FILE "index.html"
+
+char *g_szMirrorDir = DEFAULT_MIRROR_DIR;
+int g_iPipelineDepth = DEFAULT_PIPELINE_DEPTH;
+int g_iMaxHosts = DEFAULT_MAX_HOSTS;
+int g_bCrawl = 0;
+
+typedef struct fetch_s {
+    char *szFile; // path without the leading '/', owned by the fetch
+    struct timespec tsSent; // when the request was (last) sent
+    int iStatus; // HTTP status, 0 while pending, -1 if the fetch failed
+    long lBytes; // body bytes received
+} fetch_t;
+
+typedef struct host_group_s {
+    unsigned short usPort; // in host byte order
+    char *szServer;
+    fetch_t *fetches; // in request order; grows when crawling
+    int count;
+    int capacity;
+} host_group_t;
+
+typedef struct batch_stats_s {
+    int urlsOk;
+    int urlsFailed;
+    long bytes;
+} batch_stats_t;
+
+typedef struct conn_buf_s {
+    char *data; // always '\0' terminated at data[len]
+    int len;
+    int capacity;
+} conn_buf_t;
+
+typedef struct response_s {
+    int iStatus;
+    int bKeepAlive; // 0 if the server will close after this response
+    int bHtml;
+    char *body; // malloc'd and '\0' terminated, must be freed by the caller
+    long bodyLen;
+} response_t;
+
+double elapsed_ms(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000.0 +
+            (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+/* Adds szFile to the group unless it is already there. Takes a copy. */
+void group_add_file(host_group_t *group, const char *szFile) {
+    int i;
+    for (i = 0; i < group->count; i++) {
+        if (strcmp(group->fetches[i].szFile, szFile) == 0) {
+            return;
+        }
+    }
+    if (group->count == group->capacity) {
+        group->capacity = group->capacity ? group->capacity * 2 : 16;
+        group->fetches = (fetch_t*) realloc(group->fetches,
+                group->capacity * sizeof (fetch_t));
+        assert(NULL != group->fetches);
+    }
+    fetch_t *fetch = &group->fetches[group->count++];
+    memset(fetch, 0, sizeof (*fetch));
+    fetch->szFile = strdup(szFile);
+    assert(NULL != fetch->szFile);
+}
+
+/* Returns the group for server:port, creating it if needed. */
+host_group_t *find_group(host_group_t **groups, int *groupCount,
+        const char *szServer, unsigned short usPort) {
+    int i;
+    for (i = 0; i < *groupCount; i++) {
+        if ((*groups)[i].usPort == usPort &&
+                strcasecmp((*groups)[i].szServer, szServer) == 0) {
+            return &(*groups)[i];
+        }
+    }
+    *groups = (host_group_t*) realloc(*groups,
+            (*groupCount + 1) * sizeof (host_group_t));
+    assert(NULL != *groups);
+    host_group_t *group = &(*groups)[(*groupCount)++];
+    memset(group, 0, sizeof (*group));
+    group->usPort = usPort;
+    group->szServer = strdup(szServer);
+    assert(NULL != group->szServer);
+    return group;
+}
+
+/* Collapses "." and ".." segments of a '/'-separated path in place.
+ * ".." never climbs above the root, so the result stays inside the mirror. */
+void normalize_path(char *szPath) {
+    char *segments[CHUNK_SIZE];
+    int segmentCount = 0;
+    int trailingSlash = szPath[0] != '\0' && szPath[strlen(szPath) - 1] == '/';
+    char *save = NULL;
+    char *copy = strdup(szPath);
+    assert(NULL != copy);
+
+    char *segment;
+    for (segment = strtok_r(copy, "/", &save); segment != NULL;
+            segment = strtok_r(NULL, "/", &save)) {
+        if (strcmp(segment, ".") == 0) {
+            continue;
+        } else if (strcmp(segment, "..") == 0) {
+            if (segmentCount > 0) {
+                segmentCount--;
+            }
+        } else if (segmentCount < CHUNK_SIZE) {
+            segments[segmentCount++] = segment;
+        }
+    }
+
+    szPath[0] = '\0';
+    int i;
+    for (i = 0; i < segmentCount; i++) {
+        if (i > 0) {
+            strcat(szPath, "/");
+        }
+        strcat(szPath, segments[i]);
+    }
+    if (trailingSlash && segmentCount > 0) {
+        strcat(szPath, "/");
+    }
+    free(copy);
+}
+
+/* Resolves a link found in szBaseFile on the group's host to a path on the
+ * same host (no leading '/'). Returns 0 on success, -1 for links that point
+ * somewhere else or are not worth fetching (anchors, mailto:, ...). */
+int resolve_link(host_group_t *group, const char *szBaseFile,
+        const char *szLink, char *szOut, int outLen) {
+    char link[CHUNK_SIZE];
+    if (strlen(szLink) >= sizeof (link)) {
+        return -1;
+    }
+    strcpy(link, szLink);
+    link[strcspn(link, "#")] = '\0';
+    if (link[0] == '\0') {
+        return -1;
+    }
+
+    if (strncasecmp(link, "http://", 7) == 0) {
+        url_t url;
+        if (try_parse_url(link, &url) < 0) {
+            return -1;
+        }
+        int sameHost = url.usPort == group->usPort &&
+                strcasecmp(url.szServer, group->szServer) == 0;
+        if (sameHost) {
+            snprintf(szOut, outLen, "%s", url.szFile);
+        }
+        free(url.szServer);
+        free(url.szFile);
+        if (!sameHost) {
+            return -1;
+        }
+    } else if (link[0] == '/' && link[1] == '/') {
+        return -1; // protocol-relative, treat as off-site
+    } else if (link[0] == '/') {
+        snprintf(szOut, outLen, "%s", link + 1);
+    } else if (link[strcspn(link, ":/?")] == ':') {
+        return -1; // some other scheme: https:, mailto:, javascript:, ...
+    } else {
+        // Relative to the directory of the page it was found in.
+        const char *lastSlash = strrchr(szBaseFile, '/');
+        int dirLen = lastSlash ? lastSlash - szBaseFile + 1 : 0;
+        if (dirLen + strlen(link) >= outLen) {
+            return -1;
+        }
+        snprintf(szOut, outLen, "%.*s%s", dirLen, szBaseFile, link);
+    }
+    normalize_path(szOut);
+    return 0;
+}
+
+/* Queues every same-origin src= / href= target found in an HTML body. */
+void crawl_links(host_group_t *group, const char *szBaseFile,
+        const char *body, long bodyLen) {
+    const char *p = body;
+    const char *end = body + bodyLen;
+    while (p < end) {
+        int attrLen = 0;
+        if (end - p > 4 && strncasecmp(p, "src=", 4) == 0) {
+            attrLen = 4;
+        } else if (end - p > 5 && strncasecmp(p, "href=", 5) == 0) {
+            attrLen = 5;
+        }
+        // Only match whole attribute names, not e.g. "data-src=".
+        if (attrLen == 0 || (p > body && (isalnum((unsigned char) p[-1]) || p[-1] == '-'))) {
+            p++;
+            continue;
+        }
+        p += attrLen;
+
+        const char *valueEnd;
+        if (*p == '"' || *p == '\'') {
+            char quote = *p++;
+            valueEnd = memchr(p, quote, end - p);
+        } else {
+            valueEnd = p;
+            while (valueEnd < end && !isspace((unsigned char) *valueEnd) && *valueEnd != '>') {
+                valueEnd++;
+            }
+        }
+        if (valueEnd == NULL) {
+            break;
+        }
+
+        char link[CHUNK_SIZE];
+        char resolved[CHUNK_SIZE];
+        if (valueEnd - p < sizeof (link)) {
+            memcpy(link, p, valueEnd - p);
+            link[valueEnd - p] = '\0';
+            if (resolve_link(group, szBaseFile, link, resolved,
+                    sizeof (resolved)) == 0) {
+                group_add_file(group, resolved);
+            }
+        }
+        p = valueEnd;
+    }
+}
+
+/* Creates every missing directory leading up to the file at szPath. */
+int make_parent_dirs(const char *szPath) {
+    char dir[PATH_MAX];
+    if (snprintf(dir, sizeof (dir), "%s", szPath) >= sizeof (dir)) {
+        return -1;
+    }
+    char *slash;
+    for (slash = strchr(dir + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+            return -1;
+        }
+        *slash = '/';
+    }
+    return 0;
+}
+
+/* Writes a response body to <mirror>/<server>_<port>/<file>. Directory URLs
+ * ("" or ending in '/') are saved as DEFAULT_INDEX_FILE inside them. */
+int save_to_mirror(host_group_t *group, fetch_t *fetch, response_t *resp) {
+    char path[PATH_MAX];
+    int len = strlen(fetch->szFile);
+    int isDir = len == 0 || fetch->szFile[len - 1] == '/';
+    if (snprintf(path, sizeof (path), "%s/%s_%hu/%s%s", g_szMirrorDir,
+            group->szServer, group->usPort, fetch->szFile,
+            isDir ? DEFAULT_INDEX_FILE : "") >= sizeof (path)) {
+        return -1;
+    }
+    if (make_parent_dirs(path) < 0) {
+        fprintf(stderr, "Could not create directories for %s: %s\n",
+                path, strerror(errno));
+        return -1;
+    }
+    FILE *out = fopen(path, "wb");
+    if (out == NULL) {
+        fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    fwrite(resp->body, sizeof (char), resp->bodyLen, out);
+    fclose(out);
+    return 0;
+}
+
+/* Receives more data into the buffer. Returns what recv() returned. */
+int fill_buf(int sock, conn_buf_t *buf) {
+    if (buf->capacity - buf->len < CHUNK_SIZE + 1) {
+        buf->capacity = buf->capacity ? buf->capacity * 2 : CHUNK_SIZE * 4;
+        buf->data = (char*) realloc(buf->data, buf->capacity);
+        assert(NULL != buf->data);
+    }
+    int bytesRcvd = recv(sock, buf->data + buf->len, buf->capacity - buf->len - 1, 0);
+    if (bytesRcvd > 0) {
+        buf->len += bytesRcvd;
+        buf->data[buf->len] = '\0';
+    }
+    return bytesRcvd;
+}
+
+/* Drops the first 'count' bytes of the buffer. */
+void consume_buf(conn_buf_t *buf, int count) {
+    memmove(buf->data, buf->data + count, buf->len - count);
+    buf->len -= count;
+    buf->data[buf->len] = '\0';
+}
+
+/* Copies the value of header 'szName' into szOut. Returns 1 if found. */
+int get_header(const char *header, const char *szName, char *szOut, int outLen) {
+    int nameLen = strlen(szName);
+    const char *line;
+    for (line = strstr(header, "\r\n"); line != NULL; line = strstr(line, "\r\n")) {
+        line += 2;
+        if (strncasecmp(line, szName, nameLen) == 0 && line[nameLen] == ':') {
+            const char *value = line + nameLen + 1;
+            while (*value == ' ' || *value == '\t') {
+                value++;
+            }
+            int valueLen = strcspn(value, "\r\n");
+            snprintf(szOut, outLen, "%.*s", valueLen, value);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Appends bytes to a growing response body. */
+void append_body(response_t *resp, const char *data, long len) {
+    resp->body = (char*) realloc(resp->body, resp->bodyLen + len + 1);
+    assert(NULL != resp->body);
+    memcpy(resp->body + resp->bodyLen, data, len);
+    resp->bodyLen += len;
+    resp->body[resp->bodyLen] = '\0';
+}
+
+/* Reads one complete response off a (possibly pipelined) connection.
+ * Interim 1xx responses are skipped. Returns 1 on success, 0 if the
+ * connection closed or failed first, -1 if the response is malformed. */
+int read_response(int sock, conn_buf_t *buf, response_t *resp) {
+    memset(resp, 0, sizeof (*resp));
+    append_body(resp, "", 0);
+
+    int headerLen;
+    char *header;
+    for (;;) {
+        char *headerEnd = buf->data ? strstr(buf->data, delimiter) : NULL;
+        if (headerEnd == NULL) {
+            if (fill_buf(sock, buf) <= 0) {
+                return 0;
+            }
+            continue;
+        }
+        headerLen = headerEnd - buf->data + strlen(delimiter);
+
+        int major, minor;
+        if (sscanf(buf->data, "HTTP/%d.%d %d", &major, &minor, &resp->iStatus) != 3) {
+            return -1;
+        }
+        if (resp->iStatus >= 100 && resp->iStatus < 200) {
+            consume_buf(buf, headerLen);
+            continue;
+        }
+
+        header = strndup(buf->data, headerLen);
+        assert(NULL != header);
+        resp->bKeepAlive = major > 1 || (major == 1 && minor >= 1);
+        break;
+    }
+
+    char value[CHUNK_SIZE];
+    if (get_header(header, "Connection", value, sizeof (value))) {
+        if (strcasecmp(value, "close") == 0) {
+            resp->bKeepAlive = 0;
+        } else if (strcasecmp(value, "keep-alive") == 0) {
+            resp->bKeepAlive = 1;
+        }
+    }
+    resp->bHtml = get_header(header, "Content-Type", value, sizeof (value)) &&
+            strncasecmp(value, "text/html", 9) == 0;
+    int chunked = get_header(header, "Transfer-Encoding", value, sizeof (value)) &&
+            strcasecmp(value, "chunked") == 0;
+    long contentLength = -1;
+    if (get_header(header, "Content-Length", value, sizeof (value))) {
+        contentLength = atol(value);
+        if (contentLength < 0 || contentLength > INT_MAX - headerLen) {
+            return -1;
+        }
+    }
+    free(header);
+
+    if (resp->iStatus == 204 || resp->iStatus == 304) {
+        consume_buf(buf, headerLen);
+    } else if (chunked) {
+        int pos = headerLen;
+        for (;;) {
+            char *lineEnd = strstr(buf->data + pos, "\r\n");
+            if (lineEnd == NULL) {
+                if (fill_buf(sock, buf) <= 0) {
+                    return 0;
+                }
+                continue;
+            }
+            char *sizeEnd;
+            long chunkLen = strtol(buf->data + pos, &sizeEnd, 16);
+            int dataStart = lineEnd - buf->data + 2;
+            // Offsets into the buffer are ints, so the chunk has to fit too.
+            if (sizeEnd == buf->data + pos || chunkLen < 0 ||
+                    chunkLen > INT_MAX - dataStart - 2) {
+                return -1;
+            }
+            if (chunkLen == 0) {
+                // Skip any trailer lines up to the final empty line.
+                char *trailerEnd = strstr(buf->data + dataStart - 2, delimiter);
+                if (trailerEnd == NULL) {
+                    if (fill_buf(sock, buf) <= 0) {
+                        return 0;
+                    }
+                    continue;
+                }
+                consume_buf(buf, trailerEnd - buf->data + strlen(delimiter));
+                break;
+            }
+            while (buf->len < dataStart + chunkLen + 2) {
+                if (fill_buf(sock, buf) <= 0) {
+                    return 0;
+                }
+            }
+            append_body(resp, buf->data + dataStart, chunkLen);
+            pos = dataStart + chunkLen + 2;
+        }
+    } else if (contentLength >= 0) {
+        while (buf->len < headerLen + contentLength) {
+            if (fill_buf(sock, buf) <= 0) {
+                return 0;
+            }
+        }
+        append_body(resp, buf->data + headerLen, contentLength);
+        consume_buf(buf, headerLen + contentLength);
+    } else {
+        // No length given: the body runs until the server closes.
+        int bytesRcvd;
+        while ((bytesRcvd = fill_buf(sock, buf)) > 0)
+            ;
+        if (bytesRcvd < 0) {
+            return 0;
+        }
+        append_body(resp, buf->data + headerLen, buf->len - headerLen);
+        consume_buf(buf, buf->len);
+        resp->bKeepAlive = 0;
+    }
+    return 1;
+}
+
+int send_request(int sock, host_group_t *group, fetch_t *fetch) {
+    char request[CHUNK_SIZE + PATH_MAX];
+    char hostHeader[CHUNK_SIZE];
+    if (group->usPort == DEFAULT_HTTP_PORT) {
+        snprintf(hostHeader, sizeof (hostHeader), "%s", group->szServer);
+    } else {
+        snprintf(hostHeader, sizeof (hostHeader), "%s:%hu", group->szServer, group->usPort);
+    }
+    int requestLen = snprintf(request, sizeof (request),
+            "GET /%s HTTP/1.1\r\nHost: %s\r\nConnection: keep-alive\r\n\r\n",
+            fetch->szFile, hostHeader);
+    if (requestLen >= sizeof (request)) {
+        return -1;
+    }
+
+    int totalBytesSent = 0;
+    while (totalBytesSent < requestLen) {
+        int sendResult = send(sock, request + totalBytesSent,
+                requestLen - totalBytesSent, MSG_NOSIGNAL);
+        if (sendResult == -1) {
+            return -1;
+        }
+        totalBytesSent += sendResult;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &fetch->tsSent);
+    return 0;
+}
+
+void report_fetch(host_group_t *group, fetch_t *fetch) {
+    printf("%3d %9ld bytes %9.1f ms  http://%s:%hu/%s\n", fetch->iStatus,
+            fetch->lBytes, elapsed_ms(&fetch->tsSent), group->szServer,
+            group->usPort, fetch->szFile);
+    fflush(stdout);
+}
+
+/* Fetches every file of a group, reusing connections for as long as the
+ * server keeps them open. Requests that were sent but not answered when a
+ * connection goes away are resent on the next one. If a connection dies
+ * without answering anything the group falls back to one request at a time,
+ * and if that fails too the request at the head of the queue is given up. */
+batch_stats_t fetch_host_group(host_group_t *group) {
+    batch_stats_t stats;
+    memset(&stats, 0, sizeof (stats));
+
+    struct hostent *groupHost = gethostbyname(group->szServer);
+    if (groupHost == NULL) {
+        fprintf(stderr, "Invalid host '%s.'\n", group->szServer);
+        stats.urlsFailed = group->count;
+        return stats;
+    }
+    struct sockaddr_in serv_addr;
+    memset(&serv_addr, 0, sizeof (serv_addr));
+    serv_addr.sin_family = AF_INET;
+    memcpy(&serv_addr.sin_addr, groupHost->h_addr_list[0], groupHost->h_length);
+    serv_addr.sin_port = htons(group->usPort);
+
+    int depth = g_iPipelineDepth;
+    int next = 0; // first request without a response yet
+    conn_buf_t buf;
+    memset(&buf, 0, sizeof (buf));
+
+    while (next < group->count) {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock < 0 || connect(sock, (struct sockaddr*) &serv_addr, sizeof (serv_addr)) < 0) {
+            fprintf(stderr, "Connection to %s:%hu failed.\n", group->szServer, group->usPort);
+            if (sock >= 0) {
+                close(sock);
+            }
+            break;
+        }
+        buf.len = 0;
+
+        int sent = next;
+        int answered = 0;
+        for (;;) {
+            // Keep the pipeline topped up.
+            while (sent < group->count && sent - next < depth) {
+                if (send_request(sock, group, &group->fetches[sent]) < 0) {
+                    break;
+                }
+                sent++;
+            }
+            if (sent == next) {
+                break;
+            }
+
+            response_t resp;
+            int result = read_response(sock, &buf, &resp);
+            if (result <= 0) {
+                if (result < 0) {
+                    fprintf(stderr, "Malformed response from %s:%hu.\n",
+                            group->szServer, group->usPort);
+                }
+                free(resp.body);
+                break;
+            }
+
+            fetch_t *fetch = &group->fetches[next];
+            fetch->iStatus = resp.iStatus;
+            fetch->lBytes = resp.bodyLen;
+            report_fetch(group, fetch);
+            stats.bytes += resp.bodyLen;
+            // A body that didn't make it into the mirror counts as a failure.
+            if (resp.iStatus == 200 && save_to_mirror(group, fetch, &resp) < 0) {
+                stats.urlsFailed++;
+            } else {
+                stats.urlsOk++;
+            }
+            if (resp.iStatus == 200) {
+                if (g_bCrawl && resp.bHtml) {
+                    // May grow (and move) group->fetches.
+                    crawl_links(group, fetch->szFile, resp.body, resp.bodyLen);
+                }
+            }
+            free(resp.body);
+            next++;
+            answered++;
+
+            if (!resp.bKeepAlive) {
+                break;
+            }
+        }
+        close(sock);
+
+        if (answered == 0 && next < group->count) {
+            if (depth > 1) {
+                depth = 1;
+            } else {
+                group->fetches[next].iStatus = -1;
+                fprintf(stderr, "No response for http://%s:%hu/%s\n", group->szServer,
+                        group->usPort, group->fetches[next].szFile);
+                next++;
+                stats.urlsFailed++;
+            }
+        }
+    }
+    stats.urlsFailed += group->count - next;
+    free(buf.data);
+    return stats;
+}
+
+/* Adds one URL to the batch. Returns -1 if it could not be parsed. */
+int batch_add_url(host_group_t **groups, int *groupCount, const char *szURL) {
+    url_t url;
+    if (try_parse_url(szURL, &url) < 0) {
+        return -1;
+    }
+    host_group_t *group = find_group(groups, groupCount, url.szServer, url.usPort);
+    normalize_path(url.szFile);
+    group_add_file(group, url.szFile);
+    free(url.szServer);
+    free(url.szFile);
+    return 0;
+}
+
+/* Reads URLs, one per line, from 'in'. Blank lines and '#' comments are
+ * skipped. Returns how many lines could not be parsed as URLs. */
+int batch_read_urls(host_group_t **groups, int *groupCount, FILE *in) {
+    int badUrls = 0;
+    char line[CHUNK_SIZE * 4];
+    while (fgets(line, sizeof (line), in) != NULL) {
+        char *url = line + strspn(line, " \t");
+        url[strcspn(url, " \t\r\n")] = '\0';
+        if (url[0] != '\0' && url[0] != '#') {
+            if (batch_add_url(groups, groupCount, url) < 0) {
+                badUrls++;
+            }
+        }
+    }
+    return badUrls;
+}
+
+void print_usage(void) {
+    fprintf(stderr,
+            "Usage: http_client URL\n"
+            "       http_client [-f FILE] [-o DIR] [-p DEPTH] [-j HOSTS] [-r] [URL...]\n"
+            "\n"
+            "With options or several URLs, runs in batch mode: URLs from the command\n"
+            "line and FILE ('-' for stdin; stdin if no URLs are given) are fetched\n"
+            "and mirrored under DIR (default " DEFAULT_MIRROR_DIR ").\n"
+            "  -p DEPTH  requests in flight per connection (default %d)\n"
+            "  -j HOSTS  hosts fetched concurrently (default %d)\n"
+            "  -r        also fetch same-host src/href links found in HTML\n",
+            DEFAULT_PIPELINE_DEPTH, DEFAULT_MAX_HOSTS);
+}
+
+int run_batch(int argc, char **argv) {
+    char *szListFile = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "f:o:p:j:rh")) != -1) {
+        switch (opt) {
+            case 'f':
+                szListFile = optarg;
+                break;
+            case 'o':
+                g_szMirrorDir = optarg;
+                break;
+            case 'p':
+                g_iPipelineDepth = atoi(optarg);
+                break;
+            case 'j':
+                g_iMaxHosts = atoi(optarg);
+                break;
+            case 'r':
+                g_bCrawl = 1;
+                break;
+            default:
+                print_usage();
+                exit(1);
+        }
+    }
+    if (g_iPipelineDepth < 1 || g_iMaxHosts < 1) {
+        print_usage();
+        exit(1);
+    }
+
+    host_group_t *groups = NULL;
+    int groupCount = 0;
+    int badUrls = 0; // URLs that couldn't be parsed, counted as failed
+    int i;
+    for (i = optind; i < argc; i++) {
+        if (batch_add_url(&groups, &groupCount, argv[i]) < 0) {
+            badUrls++;
+        }
+    }
+    if (szListFile != NULL && strcmp(szListFile, "-") != 0) {
+        FILE *in = fopen(szListFile, "r");
+        if (in == NULL) {
+            fprintf(stderr, "Could not open %s: %s\n", szListFile, strerror(errno));
+            exit(1);
+        }
+        badUrls += batch_read_urls(&groups, &groupCount, in);
+        fclose(in);
+    } else if (szListFile != NULL || optind == argc) {
+        badUrls += batch_read_urls(&groups, &groupCount, stdin);
+    }
+
+    struct timespec tsStart;
+    clock_gettime(CLOCK_MONOTONIC, &tsStart);
+    batch_stats_t total;
+    memset(&total, 0, sizeof (total));
+    total.urlsFailed = badUrls;
+
+    /* One child per host, at most g_iMaxHosts at a time. Each child reports
+     * its totals back through a pipe just before it exits. */
+    pid_t pids[groupCount];
+    int statFds[groupCount];
+    int running = 0;
+    int started = 0;
+    fflush(stdout);
+    while (started < groupCount || running > 0) {
+        if (started < groupCount && running < g_iMaxHosts) {
+            int fds[2];
+            if (pipe(fds) < 0) {
+                fprintf(stderr, "pipe failed: %s\n", strerror(errno));
+                exit(1);
+            }
+            pid_t pid = fork();
+            if (pid < 0) {
+                fprintf(stderr, "fork failed: %s\n", strerror(errno));
+                exit(1);
+            } else if (pid == 0) {
+                close(fds[0]);
+                batch_stats_t stats = fetch_host_group(&groups[started]);
+                write(fds[1], &stats, sizeof (stats));
+                close(fds[1]);
+                _exit(0);
+            }
+            close(fds[1]);
+            pids[started] = pid;
+            statFds[started] = fds[0];
+            started++;
+            running++;
+            continue;
+        }
+
+        pid_t done = wait(NULL);
+        for (i = 0; i < started; i++) {
+            if (pids[i] == done) {
+                batch_stats_t stats;
+                memset(&stats, 0, sizeof (stats));
+                if (read(statFds[i], &stats, sizeof (stats)) != sizeof (stats)) {
+                    stats.urlsFailed = groups[i].count;
+                }
+                close(statFds[i]);
+                total.urlsOk += stats.urlsOk;
+                total.urlsFailed += stats.urlsFailed;
+                total.bytes += stats.bytes;
+                running--;
+                break;
+            }
+        }
+    }
+
+    double seconds = elapsed_ms(&tsStart) / 1000.0;
+    fprintf(stderr, "\nFetched %d URLs from %d hosts (%d failed): %ld bytes in %.3f s, %.1f KB/s\n",
+            total.urlsOk, groupCount, total.urlsFailed, total.bytes, seconds,
+            seconds > 0 ? total.bytes / 1024.0 / seconds : 0.0);
+
+    for (i = 0; i < groupCount; i++) {
+        int j;
+        for (j = 0; j < groups[i].count; j++) {
+            free(groups[i].fetches[j].szFile);
+        }
+        free(groups[i].fetches);
+        free(groups[i].szServer);
+    }
+    free(groups);
+    return total.urlsFailed > 0 ? 1 : 0;
+}
+//
+/**End batch / mirror mode**/
+
 int main(int argc, char **argv) {
     if (argc < 2) {
-        fprintf(stderr,
-                "Usage: http_client URL\n");
+        print_usage();
         exit(1);
     }
+    if (argc > 2 || argv[1][0] == '-') {
+        return run_batch(argc, argv);
+    }
 
     // Parse the URL
 
@@ -149,6 +932,19 @@ int main(int argc, char **argv) {
         }
         totalBytesRcvd += bytesRcvd;
     }
+    response[totalBytesRcvd] = '\0';
+
+    /* Drop any interim 1xx responses (e.g. 103 Early Hints) that came
+     * ahead of the real one. */
+    char *interimEnd;
+    while (strncmp(response, "HTTP/", 5) == 0 && strchr(response, ' ') != NULL &&
+            strchr(response, ' ')[1] == '1' &&
+            (interimEnd = strstr(response, delimiter)) != NULL) {
+        int interimLen = interimEnd - response + strlen(delimiter);
+        fprintf(stderr, "Skipping interim response:\n----\n%.*s", interimLen, response);
+        memmove(response, response + interimLen, totalBytesRcvd - interimLen + 1);
+        totalBytesRcvd -= interimLen;
+    }
 
     /* Setting the end of the header by the fact that a string's ending is '\0'.
      *(Changes the first character of the delimiter to \0.) */
@@ -9,10 +9,24 @@
 #include <errno.h>
 #include <time.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <assert.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <strings.h>
+#include <poll.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <sys/sendfile.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
 
 // Globals
 unsigned short g_usPort;
+unsigned short g_usTlsPort; // 0 if TLS is not enabled
+char *g_szCertFile;
+char *g_szKeyFile;
 char *pathToFile;
 
 int DEFAULT_PORT = 80;
@@ -23,16 +37,103 @@ char DEFAULT_FILE[] = "index.html";
 char DEFAULT_FILE_2[] = "index.htm";
 char DELIMITER[] = "\r\n\r\n";
 
+/* Per-client admission control. Every source IP gets a token bucket for
+ * requests and one for response bytes; a client that has run out of either
+ * gets a 429 instead of service. The bucket table is a fixed-size open
+ * addressing hash owned by the single serving loop, so it needs no locking. */
+double RATE_REQUESTS_PER_SEC = 20;
+double RATE_BURST_REQUESTS = 40;
+double RATE_BYTES_PER_SEC = 1024 * 1024;
+double RATE_BURST_BYTES = 4 * 1024 * 1024;
+#define CLIENT_TABLE_SIZE 4096 // must be a power of two
+#define CLIENT_TABLE_PROBES 8
+#define MAX_PENDING_CLIENTS 64
+#define CLIENT_TIMEOUT_SEC 5 // for a waiting client to send, or a send/recv to progress
+#define TLS_HANDSHAKE_TIMEOUT_SEC 2
+
+typedef struct client_bucket_s {
+    in_addr_t addr; // network byte order, 0 if the slot is unused
+    double lastRefill; // seconds, monotonic
+    double requestTokens;
+    double byteTokens; // may go negative after a large response
+    double virtualTime; // bytes served, for fair scheduling
+} client_bucket_t;
+
+typedef struct pending_client_s {
+    int sock;
+    in_addr_t addr;
+    int isTls; // accepted on the TLS listener
+    double acceptedAt; // seconds, monotonic
+    int isReady; // poll() has seen its request (or hang-up) arrive
+} pending_client_t;
+
+/* A client connection. TLS connections have the handshake done by OpenSSL;
+ * with SSL_OP_ENABLE_KTLS it then installs the session keys in the kernel
+ * (TCP_ULP "tls"), so file bodies can still go out with sendfile() and be
+ * encrypted in the kernel. Without kernel TLS, records are encrypted in
+ * userspace with SSL_write(). */
+typedef struct client_conn_s {
+    int sock;
+    SSL *ssl; // NULL for plaintext connections
+} client_conn_t;
+
+client_bucket_t g_clients[CLIENT_TABLE_SIZE];
+pending_client_t g_pending[MAX_PENDING_CLIENTS];
+int g_pendingCount = 0;
+double g_virtualTime = 0; // virtual time of the connection being served
+
+/* Index of the subresources each HTML file under ROOT_DIR references, built
+ * at startup and refreshed whenever a page changes. Entries are keyed by
+ * canonical path, so there is at most one per HTML file under the root,
+ * however the page was requested. Used to send "103 Early Hints" and Link
+ * preload headers with the page, so the client can start fetching its
+ * images before it has parsed the body. */
+#define MAX_PRELOADS 16
+// Characters a preload path may contain. Anything else would need
+// percent-encoding in the Link header, which getPathToFile() doesn't decode.
+#define PRELOAD_PATH_CHARS "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-._~/"
+
+typedef struct html_deps_s {
+    char *path; // canonical, e.g. /srv/site/web_root/index.htm
+    struct timespec mtime; // of the file when it was last indexed
+    off_t size; // likewise, to catch edits within the mtime granularity
+    char *linkHeaders; // "Link: ...\r\n" lines, "" if there are none
+} html_deps_t;
+
+html_deps_t *g_htmlIndex = NULL;
+int g_htmlIndexCount = 0;
+char *g_szRootRealPath = NULL; // canonical ROOT_DIR, NULL if it doesn't exist
+
 // Function Prototypes
 void parse_args(int argc, char **argv);
+unsigned short parsePort(char *szPort);
 
 int parseRequestMethod(char request[], char file[], int *responseStatus);
 int getPathToFile(char **pathToFile, char request[], int *responseStatus);
-void buildResponseHeader(int httpStatusCode, char pathToFile[], char **respHeader);
+void buildResponseHeader(int httpStatusCode, char pathToFile[], char linkHeaders[], char **respHeader);
 int getFormattedDate(char **dateString, time_t timeVal);
 int getContentType(char **contentType, char *pathToFile);
-void getResponseContent(char pathToFile[], char **respContent, int *contentLength);
 int sendResponse(char responseHeader[], char responseContent[]);
+double monotonicSeconds(void);
+client_bucket_t *getClientBucket(in_addr_t addr);
+void refillBucket(client_bucket_t *bucket, double now);
+void sendRejection(int client_sock, int httpStatusCode, int retryAfter);
+void acceptPendingClients(int svr_sock, int tls_sock);
+void dropIdleClients(double now);
+int nextClient(int svr_sock, int tls_sock, in_addr_t *clientAddr, int *isTls);
+int createListener(unsigned short usPort);
+SSL_CTX *createTlsContext(char *certFile, char *keyFile);
+int tlsHandshake(client_conn_t *conn);
+int connRecv(client_conn_t *conn, char *buf, int len);
+int connSend(client_conn_t *conn, char *buf, int len);
+int connSendFile(client_conn_t *conn, char *pathToFile, int *contentLength);
+void connClose(client_conn_t *conn);
+int getPreloadType(char **asType, char *link);
+int resolveLink(char *resolved, char *pageUrl, char *link);
+void indexHtmlFile(html_deps_t *deps);
+void indexDirectory(char *dirPath);
+html_deps_t *getHtmlDeps(char *pathToFile);
+void chargeClient(in_addr_t clientAddr, int bytesSent);
 
 // Function Implementations
 
@@ -40,46 +141,56 @@ int main(int argc, char **argv) {
     parse_args(argc, argv);
     printf("Starting TCP server on port: %hu\n", g_usPort);
 
-    // Set up listening socket address.
-    struct sockaddr_in svr_addr;
-    svr_addr.sin_family = AF_INET;
-    // Host to network short - converting given port to be used in network
-    svr_addr.sin_port = htons(g_usPort);
-    // Host to network long - allows socket to "bind to all local interfaces"
-    svr_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    // A client hanging up mid-response shouldn't take the server down.
+    signal(SIGPIPE, SIG_IGN);
 
-    // Arbitrary
-    int maxClients = 10;
+    // Find the preloadable subresources of every page up front.
+    g_szRootRealPath = realpath(ROOT_DIR, NULL);
+    indexDirectory(ROOT_DIR);
 
-    // Create listening socket.
-    int svr_sock = socket(AF_INET, SOCK_STREAM, 0);
-    // This allows the socket to be reused immediately.
-    setsockopt(svr_sock, SOL_SOCKET, SO_REUSEADDR, &(int){ 1 }, sizeof(int));
-
-    // Bind server to the given port number.
-    if (bind(svr_sock, (struct sockaddr*) &svr_addr, sizeof (svr_addr)) < 0) {
-        printf("Bind failed.\n");
+    int svr_sock = createListener(g_usPort);
+    if (svr_sock < 0) {
         return 0;
     }
 
-    // Listen for clients.
-    if (listen(svr_sock, maxClients) < 0) {
-        printf("Server full.\n");
-        return 0;
+    // Optional second listener for HTTPS.
+    int tls_sock = -1;
+    SSL_CTX *tlsContext = NULL;
+    if (g_usTlsPort != 0) {
+        if ((tlsContext = createTlsContext(g_szCertFile, g_szKeyFile)) == NULL) {
+            return 0;
+        }
+        printf("Starting TLS server on port: %hu\n", g_usTlsPort);
+        if ((tls_sock = createListener(g_usTlsPort)) < 0) {
+            return 0;
+        }
     }
 
     // Main server loop
     for (;;) {
         printf("Listening for client...\n");
         
-        // Create client address struct.
-        struct sockaddr_in client_addr;
-        socklen_t client_addr_len = sizeof (client_addr);
-
-        // Accept incoming request to connect from a client.
-        int client_sock = accept(svr_sock, (struct sockaddr*) &client_addr,
-                &client_addr_len);       
+        // Accept incoming requests and pick the one to serve next.
+        in_addr_t clientAddr;
+        int isTls;
+        client_conn_t conn = { .sock = nextClient(svr_sock, tls_sock, &clientAddr, &isTls) };
         fprintf(stderr, "Client connected.\n");
+        
+        if (isTls) {
+            conn.ssl = SSL_new(tlsContext);
+            SSL_set_fd(conn.ssl, conn.sock);
+            if (tlsHandshake(&conn) < 0) {
+                // Don't try to send close_notify to a client that never finished.
+                SSL_free(conn.ssl);
+                conn.ssl = NULL;
+                connClose(&conn);
+                continue;
+            }
+            fprintf(stderr, "TLS %s, %s%s, kernel TLS %s.\n", SSL_get_version(conn.ssl),
+                    SSL_get_cipher_name(conn.ssl),
+                    SSL_session_reused(conn.ssl) ? ", resumed" : "",
+                    BIO_get_ktls_send(SSL_get_wbio(conn.ssl)) ? "on" : "off");
+        }
 
         // Create an array to store the client's request.
         char *request;
@@ -91,9 +202,11 @@ int main(int argc, char **argv) {
         /**Receive Request**/
         //
         // Receive first chunk.
-        int bytesRcvd = recv(client_sock, request, CHUNK_SIZE, 0);
+        int bytesRcvd = connRecv(&conn, request, CHUNK_SIZE);
         if (bytesRcvd < 0) {
             fprintf(stderr, "Failed to receive\n");
+            free(request);
+            connClose(&conn);
             continue;
         }
         
@@ -106,7 +219,7 @@ int main(int argc, char **argv) {
                     reallocCount++;
                     request = realloc(request, CHUNK_SIZE + (CHUNK_SIZE * reallocCount) * sizeof(char));
                 }
-                bytesRcvd = recv(client_sock, request + totalBytesRcvd, reallocCount - totalBytesRcvd, 0);
+                bytesRcvd = connRecv(&conn, request + totalBytesRcvd, reallocCount - totalBytesRcvd);
                 if (strstr(request + totalBytesRcvd, DELIMITER) || strchr(request + totalBytesRcvd, '\0')) {
                     break;
                 }
@@ -130,41 +243,37 @@ int main(int argc, char **argv) {
             fprintf(stderr, "Out of memory error (responseHeader).\n");
             continue;
         }
-        char *responseContent;
-        if ((responseContent = malloc(CHUNK_SIZE * sizeof(char))) == NULL) {
-            fprintf(stderr, "Out of memory error (responseContent).\n");
-            continue;
-        }
         //
         /**End variable & buffer setup**/
         
         /*Parse the request: ie, is it a GET?*/        
         if (parseRequestMethod(request, pathToFile, &responseStatus) == 0) {
-            buildResponseHeader(responseStatus, NULL, &responseHeader);
+            buildResponseHeader(responseStatus, NULL, NULL, &responseHeader);
         }
         
         if (responseStatus == 0) {
             /* Get the path to the file it's requesting (if there has been no error thus far) */
             int pathResult;
             if ((pathResult = getPathToFile(&pathToFile, request, &responseStatus)) == 0) {
-                buildResponseHeader(responseStatus, NULL, &responseHeader);
+                buildResponseHeader(responseStatus, NULL, NULL, &responseHeader);
             }
         }
         
         /* If there still hasn't been an error yet, it means the requested file
            exists and the request was valid, so this should be a successful response. */
+        html_deps_t *deps = NULL; // preload links, if it's an indexed HTML page
         if (responseStatus == 0) {
             responseStatus = 200;
+            deps = getHtmlDeps(pathToFile);
             
             // The call to stat() in buildResponseHeader() appears to screw up my pathToFile variable??
             char pathBackup[strlen(pathToFile)];
             strcpy(pathBackup, pathToFile);
 
             responseStatus = 200;
-            buildResponseHeader(200, pathToFile, &responseHeader);
+            buildResponseHeader(200, pathToFile, deps != NULL ? deps->linkHeaders : NULL, &responseHeader);
 
             strcpy(pathToFile, pathBackup);        
-            getResponseContent(pathToFile, &responseContent, &contentLength);           
         }
         
         /* Sending in main() because subroutines + strings are apparently 
@@ -172,41 +281,58 @@ int main(int argc, char **argv) {
         
         int headerBytesSent = 0;
         int headerLen = strlen(responseHeader);        
+        int sendFailed = 0; // once a send fails, the rest of the response is skipped
+        
+        /* Sending early hints: the preload links for an HTML page, ahead of
+           the final response. HTTP/1.0 clients don't understand 1xx responses. */
+        if (deps != NULL && deps->linkHeaders[0] != '\0' &&
+                strstr(request, " HTTP/1.0\r\n") == NULL) {
+            char earlyHints[strlen(deps->linkHeaders) + 64];
+            sprintf(earlyHints, "HTTP/1.1 103 Early Hints\r\n%s\r\n", deps->linkHeaders);
+            fprintf(stderr, "Sending early hints...\n");
+            int hintsLen = strlen(earlyHints);
+            int hintsBytesSent = 0;
+            while (hintsBytesSent < hintsLen) {
+                int sendResult = connSend(&conn, earlyHints + hintsBytesSent, hintsLen - hintsBytesSent);
+                if (sendResult == -1) {
+                    fprintf(stderr, "Failed to send early hints.\n");
+                    sendFailed = 1;
+                    break;
+                }
+                hintsBytesSent += sendResult;
+            }
+        }
         
         /* Sending header */
         fprintf(stderr, "Sending header...\n");
-        while (headerBytesSent < headerLen) {
+        while (!sendFailed && headerBytesSent < headerLen) {
             // Keep calling send until the entire file is sent.
             // TODO: What's up with the plus one? I forget.
-            int sendResult = send(client_sock, responseHeader + headerBytesSent, headerLen - headerBytesSent, 0);
+            int sendResult = connSend(&conn, responseHeader + headerBytesSent, headerLen - headerBytesSent);
             if (sendResult == -1) {
+                // The client is gone (or stuck); retrying would just spin.
                 fprintf(stderr, "Failed to send header.\n");
-                continue;
+                sendFailed = 1;
+                break;
             }
             headerBytesSent += sendResult;
         }        
         
         /* Sending content */
-        if (responseStatus == 200) {
+        if (responseStatus == 200 && !sendFailed) {
             fprintf(stderr, "Sending content...\n");
-            int contentBytesSent = 0;
-            
-            while (contentBytesSent < contentLength) {
-                int sendResult = send(client_sock, responseContent + contentBytesSent, contentLength - contentBytesSent, 0);
-                if (sendResult == -1) {
-                    fprintf(stderr, "Failed to send content.\n");
-                    return -1;
-                }
-                contentBytesSent += sendResult;
+            if (connSendFile(&conn, pathToFile, &contentLength) < 0) {
+                fprintf(stderr, "Failed to send content.\n");
             }
         }
         
+        chargeClient(clientAddr, headerLen + (responseStatus == 200 ? contentLength : 0));
+
         free(request);
         //free(pathToFile); -> results in 'double free' error??
         free(responseHeader);
-        free(responseContent);
 
-        close(client_sock);
+        connClose(&conn);
         fprintf(stderr, "Connection closed.\n------\n\n");
     }
 
@@ -287,12 +413,8 @@ int getPathToFile(char **pathToFile, char request[], int *responseStatus) {
     strcat(pathFromRoot, *pathToFile);    
     
     if ((extension = strchr(pathFromRoot + 1, '.')) != NULL) {
-        if (strcmp(extension, ".html") == 0 ||
-            strcmp(extension, ".htm") == 0 ||
-            strcmp(extension, ".txt") == 0 ||
-            strcmp(extension, ".gif") == 0 ||
-            strcmp(extension, ".jpg") == 0 ||
-            strcmp(extension, ".jpeg") == 0) {
+        char *contentType;
+        if (getContentType(&contentType, pathFromRoot) == 1) {
             // It's a file with a supported extension.
             // Check for existence.   
             fileP = fopen(pathFromRoot, "r");
@@ -348,8 +470,11 @@ int getPathToFile(char **pathToFile, char request[], int *responseStatus) {
     }
 }
 
-void buildResponseHeader(int httpStatusCode, char *pathToFile, char **respHeader) {    
-    char *response = malloc(CHUNK_SIZE * sizeof(char));
+/* linkHeaders are extra "Link: ...\r\n" lines for a 200, or NULL. */
+void buildResponseHeader(int httpStatusCode, char *pathToFile, char *linkHeaders, char **respHeader) {    
+    int linkHeadersLen = linkHeaders != NULL ? strlen(linkHeaders) : 0;
+    
+    char *response = malloc((CHUNK_SIZE + linkHeadersLen) * sizeof(char));
     strcpy(response, "HTTP/1.1 ");
     
     switch(httpStatusCode) {
@@ -423,6 +548,10 @@ void buildResponseHeader(int httpStatusCode, char *pathToFile, char **respHeader
             strcat(response, contentType);
             strcat(response, "\r\n");
         }        
+        
+        if (linkHeaders != NULL) {
+            strcat(response, linkHeaders);
+        }
     }    
     strcat(response, "\r\n");
     *respHeader = response;
@@ -430,38 +559,6 @@ void buildResponseHeader(int httpStatusCode, char *pathToFile, char **respHeader
     fprintf(stderr, "Response Header is:\n\n%s", response);
 }
 
-/* Returns content if successful,
-           NULL if it was not, sets response status */
-void getResponseContent(char *pathToFile, char **responseContent, int *contentLength) {
-    FILE *fileP;
-    int bufferSize = CHUNK_SIZE;
-    char filePathBuffer[CHUNK_SIZE];
-    
-    /* If I don't make a copy, pathToFile gets overwritten
-     * when I call fopen(), for some reason. Clearly I'm missing something. */
-    strcpy(filePathBuffer, pathToFile);
-    
-    fileP = fopen(filePathBuffer, "rb");
-    
-    struct stat *statBuffer;
-    statBuffer = malloc(sizeof(struct stat));
-        
-    stat(filePathBuffer, statBuffer);
-    *contentLength = statBuffer->st_size;
-    
-    if (*contentLength > bufferSize) {
-        *responseContent = realloc(*responseContent, *contentLength);
-    }
-    
-    int bytesRead = fread(*responseContent, 1, *contentLength, fileP);
-    
-    fclose(fileP);
-    
-    if (bytesRead != *contentLength) {
-        fprintf(stderr, "Error reading file\n");
-    }
-}
-
 int getFormattedDate(char **dateString, time_t timeVal) {
     char buffer[100];
     struct tm *timeStrc;
@@ -479,9 +576,13 @@ int getFormattedDate(char **dateString, time_t timeVal) {
     return 1;
 }
 
+/* Also decides what the server will serve at all: getPathToFile() refuses
+ * any file this doesn't know the type of. */
 int getContentType(char **contentType, char *pathToFile) {
     char *extension = strchr(pathToFile + 1, '.');
-    if (strcmp(extension, ".html") == 0 || strcmp(extension, ".htm") == 0) {
+    if (extension == NULL) {
+        return 0;
+    } else if (strcmp(extension, ".html") == 0 || strcmp(extension, ".htm") == 0) {
         *contentType = "text/html";
     } else if (strcmp(extension, ".txt") == 0) {
         *contentType = "text/plain";
@@ -495,27 +596,665 @@ int getContentType(char **contentType, char *pathToFile) {
     return 1;
 }
 
-void parse_args(int argc, char **argv) {
-    unsigned long ulPort;
-    if (argc == 2) {
-        errno = 0;
-        char *endptr = NULL;
-        ulPort = strtoul(argv[1], &endptr, 10);
-
-        if (0 == errno) {
-            if ('\0' != endptr[0])
-                errno = EINVAL;
-            else if (ulPort > USHRT_MAX)
-                errno = ERANGE;
-        }
-        if (0 != errno) {
-            // Report any errors and abort
-            fprintf(stderr, "Failed to parse port number \"%s\": %s\n",
-                    argv[1], strerror(errno));
-            abort();
+/* Returns the 'as' value for preloading the file at urlPath, or 0 if it
+ * isn't worth preloading or this server wouldn't serve it: it has to exist
+ * under ROOT_DIR and be of a type getContentType() knows. */
+int getPreloadType(char **asType, char *urlPath) {
+    char filePath[PATH_MAX];
+    char *contentType;
+    struct stat statBuffer;
+    
+    snprintf(filePath, sizeof(filePath), "%s%s", ROOT_DIR, urlPath);
+    if (getContentType(&contentType, filePath) == 0 ||
+            stat(filePath, &statBuffer) < 0 || !S_ISREG(statBuffer.st_mode)) {
+        return 0;
+    }
+    if (strncmp(contentType, "image/", 6) == 0) {
+        *asType = "image";
+        return 1;
+    }
+    return 0;
+}
+
+/* Turns a link found in the page at pageUrl into an absolute path on this
+ * server, collapsing "." and ".." segments. Returns 0 for links to other
+ * origins (or other schemes), which can't be preloaded from here. */
+int resolveLink(char *resolved, char *pageUrl, char *link) {
+    char joined[PATH_MAX];
+    link[strcspn(link, "#?")] = '\0';
+    
+    if (link[0] == '\0' || (link[0] == '/' && link[1] == '/')) {
+        return 0;
+    } else if (link[0] == '/') {
+        snprintf(joined, sizeof(joined), "%s", link);
+    } else if (link[strcspn(link, ":/")] == ':') {
+        return 0;
+    } else {
+        int dirLen = strrchr(pageUrl, '/') - pageUrl + 1;
+        snprintf(joined, sizeof(joined), "%.*s%s", dirLen, pageUrl, link);
+    }
+    
+    resolved[0] = '\0';
+    char *save = NULL;
+    char *segment;
+    for (segment = strtok_r(joined, "/", &save); segment != NULL;
+            segment = strtok_r(NULL, "/", &save)) {
+        if (strcmp(segment, ".") == 0) {
+            continue;
+        } else if (strcmp(segment, "..") == 0) {
+            char *lastSlash = strrchr(resolved, '/');
+            if (lastSlash != NULL) {
+                *lastSlash = '\0';
+            }
+        } else {
+            strcat(resolved, "/");
+            strcat(resolved, segment);
+        }
+    }
+    return resolved[0] != '\0';
+}
+
+/* (Re)scans an HTML file for the subresources a browser would fetch right
+ * away (src= on any tag, href= on <link>) and stores them as ready-made
+ * "Link: <...>; rel=preload" header lines. */
+void indexHtmlFile(html_deps_t *deps) {
+    free(deps->linkHeaders);
+    deps->linkHeaders = strdup("");
+    
+    struct stat statBuffer;
+    FILE *fileP = fopen(deps->path, "rb");
+    if (fileP == NULL || fstat(fileno(fileP), &statBuffer) < 0) {
+        if (fileP != NULL) {
+            fclose(fileP);
+        }
+        memset(&deps->mtime, 0, sizeof(deps->mtime));
+        deps->size = -1;
+        return;
+    }
+    deps->mtime = statBuffer.st_mtim;
+    deps->size = statBuffer.st_size;
+    
+    char *html = malloc(statBuffer.st_size + 1);
+    assert(html != NULL);
+    html[fread(html, 1, statBuffer.st_size, fileP)] = '\0';
+    fclose(fileP);
+    
+    // URL path of the page, for resolving relative links.
+    char *pageUrl = deps->path + strlen(g_szRootRealPath);
+    
+    char headers[MAX_PRELOADS * (PATH_MAX + 64)];
+    headers[0] = '\0';
+    int preloadCount = 0;
+    char *tag = html;
+    while (preloadCount < MAX_PRELOADS && (tag = strchr(tag, '<')) != NULL) {
+        tag++;
+        char *tagEnd = strchr(tag, '>');
+        if (tagEnd == NULL) {
+            break;
+        }
+        *tagEnd = '\0';
+        int isLinkTag = strncasecmp(tag, "link", 4) == 0 && isspace((unsigned char) tag[4]);
+        
+        char *attr;
+        for (attr = tag; (attr = strpbrk(attr, "sShH")) != NULL; attr++) {
+            int nameLen;
+            if (strncasecmp(attr, "src=", 4) == 0) {
+                nameLen = 4;
+            } else if (isLinkTag && strncasecmp(attr, "href=", 5) == 0) {
+                nameLen = 5;
+            } else {
+                continue;
+            }
+            // Only match whole attribute names, not e.g. "data-src=".
+            if (attr == tag || !isspace((unsigned char) attr[-1])) {
+                continue;
+            }
+            
+            char link[PATH_MAX];
+            char resolved[PATH_MAX];
+            char *asType;
+            char *value = attr + nameLen;
+            if (*value == '"' || *value == '\'') {
+                char quote[2] = { *value++, '\0' };
+                snprintf(link, sizeof(link), "%.*s", (int) strcspn(value, quote), value);
+            } else {
+                snprintf(link, sizeof(link), "%.*s", (int) strcspn(value, " \t\r\n"), value);
+            }
+            if (resolveLink(resolved, pageUrl, link) &&
+                    resolved[strspn(resolved, PRELOAD_PATH_CHARS)] == '\0' &&
+                    getPreloadType(&asType, resolved)) {
+                char line[PATH_MAX + 64];
+                sprintf(line, "Link: <%s>; rel=preload; as=%s\r\n", resolved, asType);
+                if (strstr(headers, line) == NULL) {
+                    strcat(headers, line);
+                    preloadCount++;
+                }
+            }
+        }
+        tag = tagEnd + 1;
+    }
+    free(html);
+    
+    free(deps->linkHeaders);
+    deps->linkHeaders = strdup(headers);
+    fprintf(stderr, "Indexed %s: %d preload(s).\n", deps->path, preloadCount);
+}
+
+/* Adds every HTML file under dirPath to the index. Symlinked directories
+ * aren't followed, so a link loop under the root can't recurse forever. */
+void indexDirectory(char *dirPath) {
+    DIR *dir = opendir(dirPath);
+    if (dir == NULL) {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dirPath, entry->d_name);
+        
+        struct stat statBuffer;
+        if (lstat(path, &statBuffer) < 0) {
+            continue;
+        }
+        if (S_ISDIR(statBuffer.st_mode)) {
+            indexDirectory(path);
+        } else {
+            getHtmlDeps(path);
+        }
+    }
+    closedir(dir);
+}
+
+/* Returns the index entry for an HTML file, adding it or rescanning it if
+ * it's new or has changed since it was last indexed. Returns NULL for
+ * anything that isn't an HTML file under ROOT_DIR. */
+html_deps_t *getHtmlDeps(char *pathToFile) {
+    char *contentType;
+    if (g_szRootRealPath == NULL || getContentType(&contentType, pathToFile) == 0 ||
+            strcmp(contentType, "text/html") != 0) {
+        return NULL;
+    }
+    
+    // "//index.htm", "./index.htm" etc. all map to the same entry.
+    char canonical[PATH_MAX];
+    int rootLen = strlen(g_szRootRealPath);
+    struct stat statBuffer;
+    if (realpath(pathToFile, canonical) == NULL ||
+            strncmp(canonical, g_szRootRealPath, rootLen) != 0 || canonical[rootLen] != '/' ||
+            stat(canonical, &statBuffer) < 0 || !S_ISREG(statBuffer.st_mode)) {
+        return NULL;
+    }
+    
+    int i;
+    for (i = 0; i < g_htmlIndexCount; i++) {
+        html_deps_t *deps = &g_htmlIndex[i];
+        if (strcmp(deps->path, canonical) == 0) {
+            if (statBuffer.st_mtim.tv_sec != deps->mtime.tv_sec ||
+                    statBuffer.st_mtim.tv_nsec != deps->mtime.tv_nsec ||
+                    statBuffer.st_size != deps->size) {
+                indexHtmlFile(deps);
+            }
+            return deps;
+        }
+    }
+    
+    g_htmlIndex = realloc(g_htmlIndex, (g_htmlIndexCount + 1) * sizeof(html_deps_t));
+    assert(g_htmlIndex != NULL);
+    html_deps_t *deps = &g_htmlIndex[g_htmlIndexCount++];
+    memset(deps, 0, sizeof(html_deps_t));
+    deps->path = strdup(canonical);
+    indexHtmlFile(deps);
+    return deps;
+}
+
+double monotonicSeconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Returns the bucket for a client address, creating it with full buckets if
+ * the client is new. Looks at no more than CLIENT_TABLE_PROBES slots; when
+ * they are all taken the least recently refilled one is recycled. */
+client_bucket_t *getClientBucket(in_addr_t addr) {
+    unsigned int hash = (ntohl(addr) * 2654435761u) & (CLIENT_TABLE_SIZE - 1);
+    client_bucket_t *oldest = NULL;
+    int i;
+    for (i = 0; i < CLIENT_TABLE_PROBES; i++) {
+        client_bucket_t *bucket = &g_clients[(hash + i) & (CLIENT_TABLE_SIZE - 1)];
+        if (bucket->addr == addr) {
+            return bucket;
         }
+        if (bucket->addr == 0) {
+            oldest = bucket;
+            break;
+        }
+        if (oldest == NULL || bucket->lastRefill < oldest->lastRefill) {
+            oldest = bucket;
+        }
+    }
+    oldest->addr = addr;
+    oldest->lastRefill = monotonicSeconds();
+    oldest->requestTokens = RATE_BURST_REQUESTS;
+    oldest->byteTokens = RATE_BURST_BYTES;
+    oldest->virtualTime = g_virtualTime;
+    return oldest;
+}
+
+void refillBucket(client_bucket_t *bucket, double now) {
+    double elapsed = now - bucket->lastRefill;
+    bucket->lastRefill = now;
+    bucket->requestTokens += elapsed * RATE_REQUESTS_PER_SEC;
+    if (bucket->requestTokens > RATE_BURST_REQUESTS) {
+        bucket->requestTokens = RATE_BURST_REQUESTS;
+    }
+    bucket->byteTokens += elapsed * RATE_BYTES_PER_SEC;
+    if (bucket->byteTokens > RATE_BURST_BYTES) {
+        bucket->byteTokens = RATE_BURST_BYTES;
+    }
+}
+
+/* Turns a client away without parsing its request or touching the disk. */
+void sendRejection(int client_sock, int httpStatusCode, int retryAfter) {
+    char response[CHUNK_SIZE];
+    char discard[CHUNK_SIZE];
+    
+    // Drain what the client already sent, so close() doesn't reset the
+    // connection before the client reads the response.
+    while (recv(client_sock, discard, sizeof(discard), MSG_DONTWAIT) > 0)
+        ;
+    
+    int len = sprintf(response, "HTTP/1.1 %s\r\n"
+            "Retry-After: %d\r\n"
+            "Content-Length: 0\r\n"
+            "Connection: close\r\n\r\n",
+            httpStatusCode == 429 ? "429 Too Many Requests" : "503 Service Unavailable",
+            retryAfter);
+    send(client_sock, response, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(client_sock);
+}
+
+/* Accepts connections into g_pending, applying the per-client rate limits.
+ * Only takes what is already queued on the listening sockets (tls_sock is -1
+ * when TLS is not enabled), and at most MAX_PENDING_CLIENTS per call, so a
+ * client reconnecting as fast as it gets rejected can't keep the server in
+ * here. */
+void acceptPendingClients(int svr_sock, int tls_sock) {
+    int accepted;
+    for (accepted = 0; accepted < MAX_PENDING_CLIENTS; accepted++) {
+        struct pollfd pfds[2] = {
+            { .fd = svr_sock, .events = POLLIN },
+            { .fd = tls_sock, .events = POLLIN }
+        };
+        if (poll(pfds, tls_sock < 0 ? 1 : 2, 0) <= 0) {
+            return;
+        }
+        int isTls = !(pfds[0].revents & POLLIN);
+
+        // Create client address struct.
+        struct sockaddr_in client_addr;
+        socklen_t client_addr_len = sizeof (client_addr);
+
+        // Accept incoming request to connect from a client.
+        int client_sock = accept(isTls ? tls_sock : svr_sock,
+                (struct sockaddr*) &client_addr, &client_addr_len);
+        if (client_sock < 0) {
+            return;
+        }
+        
+        // Nobody gets to hold the server up by going quiet mid-request.
+        struct timeval timeout = { .tv_sec = CLIENT_TIMEOUT_SEC };
+        setsockopt(client_sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client_sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        
+        client_bucket_t *bucket = getClientBucket(client_addr.sin_addr.s_addr);
+        refillBucket(bucket, monotonicSeconds());
+        
+        if (bucket->requestTokens < 1 || bucket->byteTokens < 0) {
+            // Tell the client how long until it has a token of each kind.
+            double waitRequests = (1 - bucket->requestTokens) / RATE_REQUESTS_PER_SEC;
+            double waitBytes = -bucket->byteTokens / RATE_BYTES_PER_SEC;
+            double wait = waitRequests > waitBytes ? waitRequests : waitBytes;
+            fprintf(stderr, "Rate limiting %s.\n", inet_ntoa(client_addr.sin_addr));
+            // A TLS client would need a full handshake to read the 429,
+            // which is exactly the work being shed, so it just gets closed.
+            if (isTls) {
+                close(client_sock);
+            } else {
+                sendRejection(client_sock, 429, (int) wait + 1);
+            }
+            continue;
+        }
+        if (g_pendingCount == MAX_PENDING_CLIENTS) {
+            if (isTls) {
+                close(client_sock);
+            } else {
+                sendRejection(client_sock, 503, 1);
+            }
+            continue;
+        }
+        
+        bucket->requestTokens -= 1;
+        // A client that was idle starts at the current virtual time, so it
+        // can't bank service it didn't use.
+        if (bucket->virtualTime < g_virtualTime) {
+            bucket->virtualTime = g_virtualTime;
+        }
+        g_pending[g_pendingCount].sock = client_sock;
+        g_pending[g_pendingCount].addr = client_addr.sin_addr.s_addr;
+        g_pending[g_pendingCount].isTls = isTls;
+        g_pending[g_pendingCount].acceptedAt = monotonicSeconds();
+        g_pending[g_pendingCount].isReady = 0;
+        g_pendingCount++;
+    }
+}
+
+/* Closes waiting connections that haven't sent anything in time. Clients
+ * whose request has arrived are kept: they get served in their turn. */
+void dropIdleClients(double now) {
+    int i = 0;
+    while (i < g_pendingCount) {
+        if (!g_pending[i].isReady && now - g_pending[i].acceptedAt > CLIENT_TIMEOUT_SEC) {
+            close(g_pending[i].sock);
+            g_pendingCount--;
+            memmove(&g_pending[i], &g_pending[i + 1],
+                    (g_pendingCount - i) * sizeof(pending_client_t));
+        } else {
+            i++;
+        }
+    }
+}
+
+/* Returns the next connection to serve. Only connections that have sent
+ * something (or hung up) are considered, so an idle one can't stall the
+ * rest. Of those, the one whose client has been sent the fewest bytes (in
+ * virtual time) goes first, oldest first on ties, so a client with many
+ * connections open only gets its share of the send bandwidth rather than
+ * its share of the queue. */
+int nextClient(int svr_sock, int tls_sock, in_addr_t *clientAddr, int *isTls) {
+    int best = -1;
+    double bestTime = 0;
+    while (best < 0) {
+        acceptPendingClients(svr_sock, tls_sock);
+        
+        // Wait for a new connection or for a waiting client to send its
+        // request, waking up now and then to drop idle connections. Don't
+        // wait at all if someone is already ready.
+        struct pollfd pfds[MAX_PENDING_CLIENTS + 2];
+        int anyReady = 0;
+        int i;
+        for (i = 0; i < g_pendingCount; i++) {
+            pfds[i].fd = g_pending[i].sock;
+            pfds[i].events = POLLIN;
+            anyReady |= g_pending[i].isReady;
+        }
+        pfds[g_pendingCount].fd = svr_sock;
+        pfds[g_pendingCount].events = POLLIN;
+        pfds[g_pendingCount + 1].fd = tls_sock;
+        pfds[g_pendingCount + 1].events = POLLIN;
+        if (poll(pfds, g_pendingCount + (tls_sock < 0 ? 1 : 2),
+                anyReady ? 0 : (g_pendingCount > 0 ? 1000 : -1)) > 0) {
+            for (i = 0; i < g_pendingCount; i++) {
+                if (pfds[i].revents != 0) {
+                    g_pending[i].isReady = 1;
+                }
+            }
+        }
+        dropIdleClients(monotonicSeconds());
+        
+        for (i = 0; i < g_pendingCount; i++) {
+            if (!g_pending[i].isReady) {
+                continue;
+            }
+            double time = getClientBucket(g_pending[i].addr)->virtualTime;
+            if (best < 0 || time < bestTime) {
+                best = i;
+                bestTime = time;
+            }
+        }
+    }
+    
+    int client_sock = g_pending[best].sock;
+    *clientAddr = g_pending[best].addr;
+    *isTls = g_pending[best].isTls;
+    g_pendingCount--;
+    memmove(&g_pending[best], &g_pending[best + 1],
+            (g_pendingCount - best) * sizeof(pending_client_t));
+    if (bestTime > g_virtualTime) {
+        g_virtualTime = bestTime;
+    }
+    return client_sock;
+}
+
+/* Charges a served response to its client's byte bucket and virtual time. */
+void chargeClient(in_addr_t clientAddr, int bytesSent) {
+    client_bucket_t *bucket = getClientBucket(clientAddr);
+    refillBucket(bucket, monotonicSeconds());
+    bucket->byteTokens -= bytesSent;
+    bucket->virtualTime += bytesSent;
+}
+
+/* Returns a socket listening on all interfaces at usPort, or -1. */
+int createListener(unsigned short usPort) {
+    // Set up listening socket address.
+    struct sockaddr_in svr_addr;
+    svr_addr.sin_family = AF_INET;
+    // Host to network short - converting given port to be used in network
+    svr_addr.sin_port = htons(usPort);
+    // Host to network long - allows socket to "bind to all local interfaces"
+    svr_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    // Arbitrary
+    int maxClients = 10;
+
+    // Create listening socket.
+    int svr_sock = socket(AF_INET, SOCK_STREAM, 0);
+    // This allows the socket to be reused immediately.
+    setsockopt(svr_sock, SOL_SOCKET, SO_REUSEADDR, &(int){ 1 }, sizeof(int));
+
+    // Bind server to the given port number.
+    if (bind(svr_sock, (struct sockaddr*) &svr_addr, sizeof (svr_addr)) < 0) {
+        printf("Bind failed.\n");
+        close(svr_sock);
+        return -1;
+    }
+
+    // Listen for clients.
+    if (listen(svr_sock, maxClients) < 0) {
+        printf("Server full.\n");
+        close(svr_sock);
+        return -1;
+    }
+    return svr_sock;
+}
+
+/* Sets up the server side TLS context, or returns NULL (with the reason
+ * printed) if the certificate or key can't be loaded. */
+SSL_CTX *createTlsContext(char *certFile, char *keyFile) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (ctx == NULL) {
+        ERR_print_errors_fp(stderr);
+        return NULL;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    
+    // Hand the record layer to the kernel after the handshake when it
+    // supports it; connSendFile() falls back to SSL_write() when it doesn't.
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    
+    /* Resumption: stateless session tickets (TLS 1.3 and 1.2), backed by the
+     * server side session cache for clients that resume by session ID. */
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(ctx, (unsigned char *) "web_server", strlen("web_server"));
+    SSL_CTX_set_num_tickets(ctx, 2);
+    SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+    
+    if (SSL_CTX_use_certificate_chain_file(ctx, certFile) <= 0 ||
+            SSL_CTX_use_PrivateKey_file(ctx, keyFile, SSL_FILETYPE_PEM) <= 0 ||
+            SSL_CTX_check_private_key(ctx) <= 0) {
+        fprintf(stderr, "Failed to load certificate \"%s\" / key \"%s\".\n", certFile, keyFile);
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+/* Runs the server side of the TLS handshake within TLS_HANDSHAKE_TIMEOUT_SEC
+ * in total, however slowly the client trickles its messages in. The socket
+ * is non-blocking for the duration. Returns 0 on success, -1 on failure or
+ * timeout. */
+int tlsHandshake(client_conn_t *conn) {
+    int flags = fcntl(conn->sock, F_GETFL);
+    fcntl(conn->sock, F_SETFL, flags | O_NONBLOCK);
+    double deadline = monotonicSeconds() + TLS_HANDSHAKE_TIMEOUT_SEC;
+    int result = -1;
+    
+    for (;;) {
+        int acceptResult = SSL_accept(conn->ssl);
+        if (acceptResult == 1) {
+            result = 0;
+            break;
+        }
+        int error = SSL_get_error(conn->ssl, acceptResult);
+        if (error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) {
+            fprintf(stderr, "TLS handshake failed.\n");
+            ERR_print_errors_fp(stderr);
+            break;
+        }
+        
+        int remainingMs = (deadline - monotonicSeconds()) * 1000;
+        struct pollfd pfd = {
+            .fd = conn->sock,
+            .events = error == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT
+        };
+        if (remainingMs <= 0 || poll(&pfd, 1, remainingMs) <= 0) {
+            fprintf(stderr, "TLS handshake timed out.\n");
+            break;
+        }
+    }
+    
+    fcntl(conn->sock, F_SETFL, flags);
+    return result;
+}
+
+/* recv() for plaintext and TLS connections alike. */
+int connRecv(client_conn_t *conn, char *buf, int len) {
+    if (conn->ssl == NULL) {
+        return recv(conn->sock, buf, len, 0);
+    }
+    int result = SSL_read(conn->ssl, buf, len);
+    return result > 0 ? result : (SSL_get_error(conn->ssl, result) == SSL_ERROR_ZERO_RETURN ? 0 : -1);
+}
+
+/* send() for plaintext and TLS connections alike. */
+int connSend(client_conn_t *conn, char *buf, int len) {
+    if (conn->ssl == NULL) {
+        return send(conn->sock, buf, len, 0);
+    }
+    int result = SSL_write(conn->ssl, buf, len);
+    return result > 0 ? result : -1;
+}
+
+/* Sends the whole file as the response body and sets contentLength to its
+ * size. Plaintext and kernel TLS connections use sendfile(), so the body
+ * never gets copied into userspace; otherwise it's read in chunks and
+ * encrypted with SSL_write(). Returns 0 on success, -1 on failure. */
+int connSendFile(client_conn_t *conn, char *pathToFile, int *contentLength) {
+    int fd = open(pathToFile, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat statBuffer;
+    if (fstat(fd, &statBuffer) < 0) {
+        close(fd);
+        return -1;
+    }
+    *contentLength = statBuffer.st_size;
+    
+    off_t offset = 0;
+    int result = 0;
+    if (conn->ssl == NULL) {
+        while (offset < *contentLength) {
+            if (sendfile(conn->sock, fd, &offset, *contentLength - offset) <= 0) {
+                result = -1;
+                break;
+            }
+        }
+    } else if (BIO_get_ktls_send(SSL_get_wbio(conn->ssl))) {
+        while (offset < *contentLength) {
+            ossl_ssize_t sent = SSL_sendfile(conn->ssl, fd, offset, *contentLength - offset, 0);
+            if (sent <= 0) {
+                result = -1;
+                break;
+            }
+            offset += sent;
+        }
+    } else {
+        char buffer[16 * CHUNK_SIZE]; // one full TLS record
+        int bytesRead;
+        while (result == 0 && (bytesRead = read(fd, buffer, sizeof(buffer))) > 0) {
+            int bytesSent = 0;
+            while (bytesSent < bytesRead) {
+                int sendResult = connSend(conn, buffer + bytesSent, bytesRead - bytesSent);
+                if (sendResult == -1) {
+                    result = -1;
+                    break;
+                }
+                bytesSent += sendResult;
+            }
+        }
+    }
+    close(fd);
+    return result;
+}
+
+void connClose(client_conn_t *conn) {
+    if (conn->ssl != NULL) {
+        SSL_shutdown(conn->ssl);
+        SSL_free(conn->ssl);
+        conn->ssl = NULL;
+    }
+    close(conn->sock);
+}
+
+unsigned short parsePort(char *szPort) {
+    errno = 0;
+    char *endptr = NULL;
+    unsigned long ulPort = strtoul(szPort, &endptr, 10);
+
+    if (0 == errno) {
+        if ('\0' != endptr[0])
+            errno = EINVAL;
+        else if (ulPort > USHRT_MAX)
+            errno = ERANGE;
+    }
+    if (0 != errno) {
+        // Report any errors and abort
+        fprintf(stderr, "Failed to parse port number \"%s\": %s\n",
+                szPort, strerror(errno));
+        abort();
+    }
+    return ulPort;
+}
+
+/* Usage: web_server [port [tls_port cert.pem key.pem]] */
+void parse_args(int argc, char **argv) {
+    if (argc != 1 && argc != 2 && argc != 5) {
+        fprintf(stderr, "Usage: %s [port [tls_port cert.pem key.pem]]\n", argv[0]);
+        exit(1);
+    }
+    if (argc == 2 || argc == 5) {
+        g_usPort = parsePort(argv[1]);
     } else {
-        ulPort = DEFAULT_PORT;
+        g_usPort = DEFAULT_PORT;
+    }
+    if (argc == 5) {
+        g_usTlsPort = parsePort(argv[2]);
+        g_szCertFile = argv[3];
+        g_szKeyFile = argv[4];
     }
-    g_usPort = ulPort;
 }